@@ -0,0 +1,180 @@
+/* Reads the hook counters that anylinux.so publishes in
+ * $XDG_RUNTIME_DIR/anylinux-stats and prints their sum across all running
+ * processes, files of processes that are gone are removed
+ *
+ * BUILD:
+ *   cc -O2 anylinux-stats.c -o anylinux-stats
+ *
+ * USAGE:
+ *   anylinux-stats        print the totals
+ *   anylinux-stats -p     also print the counters of each process
+ *
+ * Counters ending in _ns are the nanoseconds spent inside that hook, the
+ * real function it ends up calling is not included
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// must match the layout in anylinux.c
+#define STATS_MAGIC "ANYLSTAT"
+#define STATS_VERSION 2
+#define STATS_MAX_COUNTERS 32
+#define STATS_NAME_LEN 32
+
+struct stats_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t ncounters;
+	uint32_t slot_size;
+	uint32_t threads; // used_slots in version 1
+	int32_t pid;
+	char exe[PATH_MAX];
+	char names[STATS_MAX_COUNTERS][STATS_NAME_LEN];
+};
+
+#define STATS_HEADER_SIZE ((sizeof(struct stats_header) + 63) & ~(size_t)63)
+
+// totals are summed by name so files of older versions with
+// different counters can still be added together
+static char total_names[STATS_MAX_COUNTERS * 2][STATS_NAME_LEN];
+static uint64_t total_values[STATS_MAX_COUNTERS * 2];
+static int total_count = 0;
+
+static void add_total(const char *name, uint64_t value) {
+	for (int i = 0; i < total_count; i++) {
+		if (strcmp(total_names[i], name) == 0) {
+			total_values[i] += value;
+			return;
+		}
+	}
+	if (total_count >= STATS_MAX_COUNTERS * 2)
+		return;
+	strncpy(total_names[total_count], name, STATS_NAME_LEN - 1);
+	total_values[total_count++] = value;
+}
+
+static void print_counter(const char *indent, const char *name, uint64_t value) {
+	size_t len = strlen(name);
+	if (len > 3 && strcmp(name + len - 3, "_ns") == 0)
+		printf("%s%-28s %20llu (%.3f ms)\n", indent, name,
+			(unsigned long long)value, (double)value / 1e6);
+	else
+		printf("%s%-28s %20llu\n", indent, name, (unsigned long long)value);
+}
+
+// returns 1 if the file was read, 0 if it was skipped
+static int read_stats_file(const char *path, int per_process) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < STATS_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	const struct stats_header *h = (const struct stats_header *)map;
+	if (memcmp(h->magic, STATS_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version < 1 || h->version > STATS_VERSION ||
+	    h->ncounters > STATS_MAX_COUNTERS ||
+	    h->ncounters * sizeof(uint64_t) > h->slot_size ||
+	    STATS_HEADER_SIZE + (size_t)h->nslots * h->slot_size > (size_t)st.st_size) {
+		munmap((void *)map, st.st_size);
+		return 0;
+	}
+
+	// version 1 handed out slots in order, later versions pick them by tid
+	uint32_t threads = __atomic_load_n(&h->threads, __ATOMIC_RELAXED);
+	uint32_t nslots = h->nslots;
+	if (h->version == 1 && threads < nslots)
+		nslots = threads;
+
+	if (per_process)
+		printf("pid %d (%s), %u threads\n", h->pid, h->exe, threads);
+
+	for (uint32_t c = 0; c < h->ncounters; c++) {
+		uint64_t value = 0;
+		for (uint32_t s = 0; s < nslots; s++) {
+			const uint64_t *slot = (const uint64_t *)(map + STATS_HEADER_SIZE + (size_t)s * h->slot_size);
+			value += __atomic_load_n(&slot[c], __ATOMIC_RELAXED);
+		}
+		char name[STATS_NAME_LEN];
+		memcpy(name, h->names[c], STATS_NAME_LEN);
+		name[STATS_NAME_LEN - 1] = '\0';
+		add_total(name, value);
+		if (per_process)
+			print_counter("  ", name, value);
+	}
+
+	munmap((void *)map, st.st_size);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	int per_process = argc > 1 && strcmp(argv[1], "-p") == 0;
+	if (argc > 1 && !per_process) {
+		fprintf(stderr, "USAGE: %s [-p]\n", argv[0]);
+		return 1;
+	}
+
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (!runtime_dir || !*runtime_dir) {
+		fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+		return 1;
+	}
+
+	char dir_path[PATH_MAX];
+	snprintf(dir_path, sizeof(dir_path), "%s/anylinux-stats", runtime_dir);
+	DIR *dir = opendir(dir_path);
+	if (!dir) {
+		fprintf(stderr, "Cannot open %s: %s\n", dir_path, strerror(errno));
+		return 1;
+	}
+
+	int processes = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		// files are named <pid>-<id>, remove the ones of dead processes
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+		pid_t pid = (pid_t)strtol(entry->d_name, NULL, 10);
+		if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+			unlink(path);
+			continue;
+		}
+		processes += read_stats_file(path, per_process);
+	}
+	closedir(dir);
+
+	if (per_process)
+		printf("\n");
+	printf("total of %d processes\n", processes);
+	for (int i = 0; i < total_count; i++)
+		print_counter("  ", total_names[i], total_values[i]);
+
+	return 0;
+}
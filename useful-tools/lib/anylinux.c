@@ -22,24 +22,52 @@
  *
  * It also makes sure $APPDIR/bin is always present in PATH, since apps
  * may clear their own environ before executing a helper binary
+ *
+ * It also redirects dlopen calls with a full path inside APPDIR to optimized
+ * x86-64-v2/v3/v4 variants in a glibc-hwcaps subdir next to the library when
+ * the CPU supports them, ld.so already does this for libraries found by name
+ *
+ * It also remembers libraries that failed to dlopen by name in the XDG cache,
+ * so repeat launches do not search every library dir again for optional libs
+ * that are missing on this host, set ANYLINUX_DLOPEN_CACHE=0 to disable it
+ *
+ * It also counts what the hooks do and how long they take in a small shared
+ * memory file per process in $XDG_RUNTIME_DIR/anylinux-stats, which can be read
+ * with anylinux-stats.c while the application runs, ANYLINUX_STATS=0 disables it
+ *
+ * It also offers an opt-in startup profiler, set ANYLINUX_STARTUP_PROFILE=1 to
+ * log a one-line breakdown of the startup time of the process, see below
 */
 
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
+#include <dirent.h>
 #include <dlfcn.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <link.h>
 #include <locale.h>
+#include <pthread.h>
+#include <signal.h>
 #include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 typedef int (*execve_func_t)(const char *filename, char *const argv[], char *const envp[]);
 typedef int (*posix_spawn_func_t)(pid_t *pid, const char *path,
@@ -47,6 +75,7 @@ typedef int (*posix_spawn_func_t)(pid_t *pid, const char *path,
 		const posix_spawnattr_t *attrp, char *const argv[],
 		char *const envp[]);
 typedef void *(*dlopen_func_t)(const char *filename, int flags);
+typedef char *(*dlerror_func_t)(void);
 
 #define VISIBLE __attribute__ ((visibility ("default")))
 
@@ -61,6 +90,439 @@ static int appimage_exec_debug_enabled(void) {
 		fprintf(stderr, " [anylinux.so] >> " __VA_ARGS__); \
 	while (0)
 
+// Opt-in startup profiler, enabled with ANYLINUX_STARTUP_PROFILE=1 which logs to
+// ${XDG_RUNTIME_DIR:-/tmp}/anylinux-startup.log or set it to the path of a log file
+// All milestones are relative to the process start time in /proc/self/stat:
+//   loader_and_lib_ctors  process start -> constructor of anylinux.so
+//                (exec chain, ld.so loading and relocating, and the constructors
+//                of the libraries the app links to, which run before preloads)
+//   exe_ctors    constructor of anylinux.so -> main()
+//                (constructors of the preloads after it and of the executable)
+//   app_init     main() -> GApplication created
+//   first_window GApplication created -> first toplevel gets its app id
+//   first_dlopen process start -> first dlopen call, reported on its own
+// The GTK milestones are reported by gtk-class-fix.so via anylinux_startup_mark()
+// The line is written when the first window is created or at exit otherwise
+enum startup_milestone {
+	STARTUP_CTOR,
+	STARTUP_MAIN,
+	STARTUP_FIRST_DLOPEN,
+	STARTUP_APP_NEW,
+	STARTUP_FIRST_WINDOW,
+	STARTUP_MILESTONES
+};
+
+static const char *startup_milestone_names[STARTUP_MILESTONES] = {
+	"ctor", "main", "first_dlopen", "app_new", "first_window"
+};
+
+static int startup_profile_enabled = 0;
+static int startup_profile_written = 0;
+static pid_t startup_profile_pid = 0;
+static char startup_profile_log[PATH_MAX] = "";
+static long long startup_process_start_ns = 0;
+static long long startup_milestones_ns[STARTUP_MILESTONES];
+
+static long long boottime_ns(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_BOOTTIME, &ts) != 0)
+		return 0;
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// starttime is field 22 of /proc/self/stat, in clock ticks since boot
+static long long read_process_start_ns(void) {
+	char buf[1024];
+	int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+
+	// the process name may contain spaces, skip past it
+	char *p = strrchr(buf, ')');
+	if (!p)
+		return 0;
+	for (int field = 2; field < 22 && p; field++)
+		p = strchr(p + 1, ' ');
+	if (!p)
+		return 0;
+
+	long ticks_per_sec = sysconf(_SC_CLK_TCK);
+	if (ticks_per_sec <= 0)
+		return 0;
+	long long ticks = strtoll(p + 1, NULL, 10);
+	return ticks * (1000000000LL / ticks_per_sec);
+}
+
+// from == STARTUP_MILESTONES measures from the process start
+static void startup_format_ms(char *out, size_t out_size, enum startup_milestone from, enum startup_milestone to) {
+	long long a = from == STARTUP_MILESTONES ? startup_process_start_ns : startup_milestones_ns[from];
+	long long b = startup_milestones_ns[to];
+	if (a && b)
+		snprintf(out, out_size, "%.1fms", (double)(b - a) / 1e6);
+	else
+		snprintf(out, out_size, "-");
+}
+
+static void startup_profile_write(void) {
+	if (!startup_profile_enabled || __atomic_exchange_n(&startup_profile_written, 1, __ATOMIC_ACQ_REL))
+		return;
+	// forked children inherit the milestones of the parent, do not log those
+	if (getpid() != startup_profile_pid)
+		return;
+
+	enum startup_milestone init_end = startup_milestones_ns[STARTUP_APP_NEW] ? STARTUP_APP_NEW : STARTUP_FIRST_WINDOW;
+	enum startup_milestone window_start = startup_milestones_ns[STARTUP_APP_NEW] ? STARTUP_APP_NEW : STARTUP_MAIN;
+	char loader_and_lib_ctors[32], exe_ctors[32], app_init[32], first_window[32], first_dlopen[32], total[32];
+	startup_format_ms(loader_and_lib_ctors, sizeof(loader_and_lib_ctors), STARTUP_MILESTONES, STARTUP_CTOR);
+	startup_format_ms(exe_ctors, sizeof(exe_ctors), STARTUP_CTOR, STARTUP_MAIN);
+	startup_format_ms(app_init, sizeof(app_init), STARTUP_MAIN, init_end);
+	startup_format_ms(first_window, sizeof(first_window), window_start, STARTUP_FIRST_WINDOW);
+	startup_format_ms(first_dlopen, sizeof(first_dlopen), STARTUP_MILESTONES, STARTUP_FIRST_DLOPEN);
+	startup_format_ms(total, sizeof(total), STARTUP_MILESTONES, STARTUP_FIRST_WINDOW);
+
+	char exe[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	exe[len > 0 ? len : 0] = '\0';
+
+	char line[PATH_MAX + 256];
+	int n = snprintf(line, sizeof(line),
+		"pid=%d exe=%s loader_and_lib_ctors=%s exe_ctors=%s app_init=%s first_window=%s total=%s first_dlopen=%s\n",
+		(int)getpid(), exe[0] ? exe : "(unknown)",
+		loader_and_lib_ctors, exe_ctors, app_init, first_window, total, first_dlopen);
+	if (n <= 0)
+		return;
+	if ((size_t)n >= sizeof(line))
+		n = sizeof(line) - 1;
+
+	// a single O_APPEND write keeps lines of concurrent processes intact
+	int fd = open(startup_profile_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		DEBUG_PRINT("startup profile: cannot open %s: %s\n", startup_profile_log, strerror(errno));
+		return;
+	}
+	if (write(fd, line, n) != n)
+		DEBUG_PRINT("startup profile: failed to write to %s\n", startup_profile_log);
+	close(fd);
+}
+
+// Only the first time a milestone is reached is recorded
+VISIBLE void anylinux_startup_mark(const char *milestone) {
+	if (!startup_profile_enabled || !milestone)
+		return;
+
+	for (int i = 0; i < STARTUP_MILESTONES; i++) {
+		if (strcmp(milestone, startup_milestone_names[i]) != 0)
+			continue;
+		long long expected = 0;
+		long long now = boottime_ns();
+		if (__atomic_compare_exchange_n(&startup_milestones_ns[i], &expected, now,
+		                                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			DEBUG_PRINT("startup profile: reached %s\n", milestone);
+			if (i == STARTUP_FIRST_WINDOW)
+				startup_profile_write();
+		}
+		return;
+	}
+}
+
+__attribute__((constructor(101)))
+static void init_startup_profile(void) {
+	const char *v = getenv("ANYLINUX_STARTUP_PROFILE");
+	if (!v || !*v || strcmp(v, "0") == 0)
+		return;
+
+	if (strcmp(v, "1") == 0) {
+		const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+		snprintf(startup_profile_log, sizeof(startup_profile_log), "%s/anylinux-startup.log",
+			runtime_dir && *runtime_dir ? runtime_dir : "/tmp");
+	} else {
+		strncpy(startup_profile_log, v, sizeof(startup_profile_log) - 1);
+	}
+
+	startup_process_start_ns = read_process_start_ns();
+	startup_profile_pid = getpid();
+	startup_profile_enabled = 1;
+	anylinux_startup_mark("ctor");
+	atexit(startup_profile_write);
+}
+
+// Wrap main() to know when the constructors are done, this is only used by
+// the startup profiler, the program is called as it is otherwise
+typedef int (*main_func_t)(int, char **, char **);
+typedef int (*libc_start_main_func_t)(main_func_t main, int argc, char **argv,
+		void (*init)(void), void (*fini)(void),
+		void (*rtld_fini)(void), void *stack_end);
+static main_func_t real_main;
+
+static int startup_profile_main(int argc, char **argv, char **envp) {
+	anylinux_startup_mark("main");
+	return real_main(argc, argv, envp);
+}
+
+VISIBLE int __libc_start_main(main_func_t main, int argc, char **argv,
+		void (*init)(void), void (*fini)(void),
+		void (*rtld_fini)(void), void *stack_end) {
+	libc_start_main_func_t libc_start_main_orig = dlsym(RTLD_NEXT, "__libc_start_main");
+	if (!libc_start_main_orig) {
+		DEBUG_PRINT("Error getting original __libc_start_main symbol: %s\n", dlerror());
+		abort();
+	}
+	if (startup_profile_enabled) {
+		real_main = main;
+		main = startup_profile_main;
+	}
+	return libc_start_main_orig(main, argc, argv, init, fini, rtld_fini, stack_end);
+}
+
+// Hook counters published in $XDG_RUNTIME_DIR/anylinux-stats/<pid>-<id>
+// The file is mmapped and has a header followed by slots of counters, threads
+// pick a slot from their tid so they rarely fight over the same cache line and
+// slots of finished threads get reused. Updates are relaxed atomic adds without
+// locks, cheap enough to always be on, threads that share a slot lose nothing.
+// Forked children count exec and posix_spawn into the file of their parent,
+// since most of them only fork to exec, and get their own file once they count
+// anything else. Files of processes that are gone, including the ones that
+// crashed or were killed, are removed by anylinux-stats and every now and then
+// when a process creates its file.
+// The _ns counters are the time spent in the hook itself, the real exec,
+// posix_spawn or dlopen it hands over to is not included.
+// The counter names are stored in the header so the reader does not need to
+// know them, the layout must match anylinux-stats.c
+#define STATS_MAGIC "ANYLSTAT"
+#define STATS_VERSION 2
+#define STATS_SLOTS 64
+#define STATS_MAX_COUNTERS 32
+#define STATS_NAME_LEN 32
+// one in this many processes prunes the files of dead ones, by pid
+#define STATS_PRUNE_INTERVAL 64
+
+enum stats_counter {
+	STAT_EXEC_CLEANED,
+	STAT_EXEC_PASSTHROUGH,
+	STAT_EXEC_NS,
+	STAT_SPAWN_CLEANED,
+	STAT_SPAWN_PASSTHROUGH,
+	STAT_SPAWN_NS,
+	STAT_DLOPEN_BLOCKED,
+	STAT_DLOPEN_REDIRECTED,
+	STAT_DLOPEN_CACHED_MISSING,
+	STAT_DLOPEN_PASSTHROUGH,
+	STAT_DLOPEN_NS,
+	STAT_BINDTEXTDOMAIN_REDIRECTED,
+	STAT_BINDTEXTDOMAIN_PASSTHROUGH,
+	STAT_BINDTEXTDOMAIN_NS,
+	STAT_COUNTERS
+};
+
+static const char *stats_counter_names[STAT_COUNTERS] = {
+	"exec_cleaned",
+	"exec_passthrough",
+	"exec_ns",
+	"spawn_cleaned",
+	"spawn_passthrough",
+	"spawn_ns",
+	"dlopen_blocked",
+	"dlopen_redirected",
+	"dlopen_cached_missing",
+	"dlopen_passthrough",
+	"dlopen_ns",
+	"bindtextdomain_redirected",
+	"bindtextdomain_passthrough",
+	"bindtextdomain_ns",
+};
+
+struct stats_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t ncounters;
+	uint32_t slot_size;
+	uint32_t threads;
+	int32_t pid;
+	char exe[PATH_MAX];
+	char names[STATS_MAX_COUNTERS][STATS_NAME_LEN];
+};
+
+// each slot starts in its own cache line
+#define STATS_HEADER_SIZE ((sizeof(struct stats_header) + 63) & ~(size_t)63)
+#define STATS_SLOT_SIZE ((STAT_COUNTERS * sizeof(uint64_t) + 63) & ~(size_t)63)
+
+static struct stats_header *stats_map = NULL;
+static struct stats_header *stats_parent_map = NULL;
+static int stats_state = 0; // 0 not created, 1 creating, 2 ready, -1 disabled
+static pid_t stats_pid = 0;
+static char stats_file[PATH_MAX] = "";
+static int stats_atexit_registered = 0;
+static __thread uint64_t *stats_slot = NULL;
+
+static void stats_remove_file(void) {
+	if (stats_file[0] && getpid() == stats_pid)
+		unlink(stats_file);
+}
+
+// the child only has the forking thread, start over so it makes its own file,
+// the mapping of the parent is kept to count exec and posix_spawn into it
+static void stats_atfork_child(void) {
+	if (stats_map)
+		stats_parent_map = stats_map;
+	stats_map = NULL;
+	stats_file[0] = '\0';
+	stats_slot = NULL;
+	__atomic_store_n(&stats_state, 0, __ATOMIC_RELEASE);
+}
+
+// files are named <pid>-<id>, remove the ones of processes that are gone
+static void stats_prune_files(const char *dir) {
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		pid_t pid = (pid_t)strtol(entry->d_name, NULL, 10);
+		if (pid > 0 && pid != stats_pid && kill(pid, 0) != 0 && errno == ESRCH) {
+			DEBUG_PRINT("stats: removing %s of dead process %d\n", entry->d_name, (int)pid);
+			unlinkat(dirfd(d), entry->d_name, 0);
+		}
+	}
+	closedir(d);
+}
+
+static void stats_create(void) {
+	const char *v = getenv("ANYLINUX_STATS");
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if ((v && strcmp(v, "0") == 0) || !runtime_dir || !*runtime_dir) {
+		__atomic_store_n(&stats_state, -1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s/anylinux-stats", runtime_dir);
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		DEBUG_PRINT("stats: cannot create %s: %s\n", dir, strerror(errno));
+		__atomic_store_n(&stats_state, -1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	// the pid stays the same after exec, add a timestamp to keep the file
+	// of the previous image around with its counters until the pid is gone
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	stats_pid = getpid();
+	if (stats_pid % STATS_PRUNE_INTERVAL == 0)
+		stats_prune_files(dir);
+	snprintf(stats_file, sizeof(stats_file), "%s/%d-%lld%09ld", dir,
+		(int)stats_pid, (long long)ts.tv_sec, ts.tv_nsec);
+
+	size_t size = STATS_HEADER_SIZE + STATS_SLOTS * STATS_SLOT_SIZE;
+	int fd = open(stats_file, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate(fd, size) != 0) {
+		DEBUG_PRINT("stats: cannot create %s: %s\n", stats_file, strerror(errno));
+		if (fd >= 0) {
+			unlink(stats_file);
+			close(fd);
+		}
+		__atomic_store_n(&stats_state, -1, __ATOMIC_RELEASE);
+		return;
+	}
+	struct stats_header *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(stats_file);
+		__atomic_store_n(&stats_state, -1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	map->version = STATS_VERSION;
+	map->nslots = STATS_SLOTS;
+	map->ncounters = STAT_COUNTERS;
+	map->slot_size = STATS_SLOT_SIZE;
+	map->pid = stats_pid;
+	ssize_t len = readlink("/proc/self/exe", map->exe, sizeof(map->exe) - 1);
+	map->exe[len > 0 ? len : 0] = '\0';
+	for (int i = 0; i < STAT_COUNTERS; i++)
+		strncpy(map->names[i], stats_counter_names[i], STATS_NAME_LEN - 1);
+	// readers ignore the file until the magic is there
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(map->magic, STATS_MAGIC, sizeof(map->magic));
+
+	stats_map = map;
+	if (stats_parent_map) {
+		munmap(stats_parent_map, size);
+		stats_parent_map = NULL;
+	}
+	if (!stats_atexit_registered) {
+		atexit(stats_remove_file);
+		stats_atexit_registered = 1;
+	}
+	__atomic_store_n(&stats_state, 2, __ATOMIC_RELEASE);
+	DEBUG_PRINT("stats: publishing hook counters in %s\n", stats_file);
+}
+
+static uint64_t *stats_slot_of(struct stats_header *map) {
+	size_t slot = (size_t)syscall(SYS_gettid) % STATS_SLOTS;
+	return (uint64_t *)((char *)map + STATS_HEADER_SIZE + slot * STATS_SLOT_SIZE);
+}
+
+// returns the counters of the calling thread or NULL if not available
+static uint64_t *stats_get_slot(void) {
+	if (stats_slot)
+		return stats_slot;
+
+	int state = __atomic_load_n(&stats_state, __ATOMIC_ACQUIRE);
+	if (state == 0) {
+		int expected = 0;
+		if (__atomic_compare_exchange_n(&stats_state, &expected, 1, 0,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			stats_create();
+		state = __atomic_load_n(&stats_state, __ATOMIC_ACQUIRE);
+	}
+	// another thread is still creating the file, skip counting this once
+	if (state != 2)
+		return NULL;
+
+	__atomic_fetch_add(&stats_map->threads, 1, __ATOMIC_RELAXED);
+	stats_slot = stats_slot_of(stats_map);
+	return stats_slot;
+}
+
+static void stats_add(enum stats_counter counter, uint64_t value) {
+	uint64_t *slot = stats_get_slot();
+	if (slot)
+		__atomic_fetch_add(&slot[counter], value, __ATOMIC_RELAXED);
+}
+
+// for exec and posix_spawn, a forked child that has no file of its own
+// counts them into the one of its parent instead of creating a file
+static void stats_add_process(enum stats_counter counter, uint64_t value) {
+	if (stats_parent_map && __atomic_load_n(&stats_state, __ATOMIC_ACQUIRE) == 0) {
+		uint64_t *slot = stats_slot_of(stats_parent_map);
+		__atomic_fetch_add(&slot[counter], value, __ATOMIC_RELAXED);
+		return;
+	}
+	stats_add(counter, value);
+}
+
+static uint64_t stats_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_add_time(enum stats_counter counter, uint64_t start_ns) {
+	stats_add(counter, stats_now_ns() - start_ns);
+}
+
+__attribute__((constructor))
+static void init_stats(void) {
+	pthread_atfork(NULL, NULL, stats_atfork_child);
+	(void)stats_get_slot();
+}
+
 // Override the name of the running program
 __attribute__((constructor))
 static void spoof_argv0(int argc, char **argv) {
@@ -150,6 +612,7 @@ static void init_bindtextdomain_override(void) {
 }
 
 VISIBLE char *bindtextdomain(const char *domainname, const char *dirname) {
+	uint64_t start_ns = stats_now_ns();
 	const char *use_dir = dirname;
 	if (dirname && strcmp(dirname, "/usr/share/locale") == 0) {
 		if (override_textdomaindir && *override_textdomaindir) {
@@ -165,7 +628,10 @@ VISIBLE char *bindtextdomain(const char *domainname, const char *dirname) {
 			DEBUG_PRINT("Overriding bindtextdomain call to (%s) -> %s\n", dirname, use_dir);
 		}
 	}
-	return real_bindtextdomain ? real_bindtextdomain(domainname, use_dir) : NULL;
+	stats_add(use_dir != dirname ? STAT_BINDTEXTDOMAIN_REDIRECTED : STAT_BINDTEXTDOMAIN_PASSTHROUGH, 1);
+	char *ret = real_bindtextdomain ? real_bindtextdomain(domainname, use_dir) : NULL;
+	stats_add_time(STAT_BINDTEXTDOMAIN_NS, start_ns);
+	return ret;
 }
 
 // Check if a library should be blocked from loading via dlopen
@@ -386,6 +852,7 @@ static int spawn_common(posix_spawn_func_t fn,
 						const posix_spawnattr_t *attrp,
 						char *const argv[], char *const envp[])
 {
+	uint64_t start_ns = stats_now_ns();
 	char *fullpath = canonicalize_file_name(path);
 	const char *path_to_check = fullpath ? fullpath : path;
 
@@ -400,6 +867,8 @@ static int spawn_common(posix_spawn_func_t fn,
 		}
 	}
 
+	stats_add_process(env != envp ? STAT_SPAWN_CLEANED : STAT_SPAWN_PASSTHROUGH, 1);
+	stats_add_process(STAT_SPAWN_NS, stats_now_ns() - start_ns);
 	int ret = fn(pid, path, file_actions, attrp, argv, env);
 
 	if (env != envp)
@@ -410,6 +879,7 @@ static int spawn_common(posix_spawn_func_t fn,
 }
 
 static int exec_common(execve_func_t function, const char *filename, char* const argv[], char* const envp[]) {
+	uint64_t start_ns = stats_now_ns();
 	DEBUG_PRINT("Preparing to exec: %s\n", filename);
 
 	char *fullpath = canonicalize_file_name(filename);
@@ -449,6 +919,8 @@ static int exec_common(execve_func_t function, const char *filename, char* const
 			DEBUG_PRINT("Internal process; leaving environment unchanged\n");
 	}
 
+	int cleaned = env != envp;
+
 	// Ensure PATH is always present at exec time. Process may have already cleared environ.
 	// glibc's execvpe(3) reads PATH via getenv() from the current process's environ,
 	// NOT from the envp parameter — so injecting into envp is not enough. We must also
@@ -490,6 +962,10 @@ static int exec_common(execve_func_t function, const char *filename, char* const
 		}
 	}
 
+	// the time spent after this is the exec itself, which only returns on failure
+	stats_add_process(cleaned ? STAT_EXEC_CLEANED : STAT_EXEC_PASSTHROUGH, 1);
+	stats_add_process(STAT_EXEC_NS, stats_now_ns() - start_ns);
+
 	DEBUG_PRINT("Calling exec for %s\n", filename);
 	int ret = function(filename, argv, env);
 
@@ -607,24 +1083,609 @@ static void init_nssfix(void) {
 	DEBUG_PRINT("nssfix: Ignoring host nsswitch.conf, using only files+dns\n");
 }
 
-// Intercept dlopen to block loading of specific libraries
-VISIBLE void *dlopen(const char *filename, int flags) {
-	dlopen_func_t dlopen_orig = dlsym(RTLD_NEXT, "dlopen");
-	if (!dlopen_orig) {
-		DEBUG_PRINT("Error getting original dlopen symbol: %s\n", dlerror());
+// Detect the x86-64 microarchitecture level of the CPU, returns 1 for baseline
+// see https://en.wikipedia.org/wiki/X86-64#Microarchitecture_levels
+// These are the same checks glibc uses to pick glibc-hwcaps/x86-64-vN subdirs
+// Set ANYLINUX_X86_64_LEVEL to lower the level used for full-path dlopen
+// redirects, 1 disables them. It does not change what ld.so picks by itself
+// for startup dependencies and dlopen by name, for those mask the CPU features
+// with GLIBC_TUNABLES=glibc.cpu.hwcaps=-AVX2,... before the app starts
+static int x86_64_level = 0;
+
+#if defined(__x86_64__)
+static int detect_x86_64_level(void) {
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int ecx1, ebx7 = 0, ecx_ext = 0;
+	unsigned int xcr0 = 0;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx1, &edx))
+		return 1;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		ebx7 = ebx;
+	if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx))
+		ecx_ext = ecx;
+
+	// the OS must also save the AVX/AVX-512 registers for us to use them
+	if (ecx1 & bit_OSXSAVE) {
+		unsigned int xcr0_hi;
+		__asm__ volatile ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+	}
+
+	const unsigned int v2_ecx1 = bit_SSE3 | bit_SSSE3 | bit_CMPXCHG16B |
+	                             bit_SSE4_1 | bit_SSE4_2 | bit_POPCNT;
+	if ((ecx1 & v2_ecx1) != v2_ecx1 || !(ecx_ext & bit_LAHF_LM))
+		return 1;
+
+	const unsigned int v3_ecx1 = bit_FMA | bit_MOVBE | bit_AVX | bit_F16C;
+	const unsigned int v3_ebx7 = bit_BMI | bit_AVX2 | bit_BMI2;
+	if ((ecx1 & v3_ecx1) != v3_ecx1 || (ebx7 & v3_ebx7) != v3_ebx7 ||
+	    !(ecx_ext & bit_LZCNT) || (xcr0 & 0x6) != 0x6)
+		return 2;
+
+	const unsigned int v4_ebx7 = bit_AVX512F | bit_AVX512DQ | bit_AVX512CD |
+	                             bit_AVX512BW | bit_AVX512VL;
+	if ((ebx7 & v4_ebx7) != v4_ebx7 || (xcr0 & 0xe6) != 0xe6)
+		return 3;
+
+	return 4;
+}
+#else
+static int detect_x86_64_level(void) {
+	return 1;
+}
+#endif
+
+static int get_x86_64_level(void) {
+	int level = __atomic_load_n(&x86_64_level, __ATOMIC_ACQUIRE);
+	if (level)
+		return level;
+
+	level = detect_x86_64_level();
+	const char *max_level = getenv("ANYLINUX_X86_64_LEVEL");
+	if (max_level && *max_level) {
+		int max = atoi(max_level);
+		if (max >= 1 && max < level)
+			level = max;
+	}
+
+	__atomic_store_n(&x86_64_level, level, __ATOMIC_RELEASE);
+	return level;
+}
+
+__attribute__((constructor))
+static void init_x86_64_level(void) {
+	int level = get_x86_64_level();
+	if (level > 1)
+		DEBUG_PRINT("CPU supports x86-64-v%d\n", level);
+}
+
+// levels that have variants somewhere in the AppDir, _deploy_hwcaps_libs of
+// quick-sharun lists them in $APPDIR/.hwcaps so AppImages without variants
+// do not pay for failing lookups on every dlopen, -1 until the file is read
+static int hwcaps_levels = -1;
+
+static int get_hwcaps_levels(void) {
+	int levels = __atomic_load_n(&hwcaps_levels, __ATOMIC_ACQUIRE);
+	if (levels >= 0)
+		return levels;
+
+	levels = 0;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/.hwcaps", saved_appdir);
+	FILE *f = fopen(path, "re");
+	if (f) {
+		char line[64];
+		int level;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "x86-64-v%d", &level) == 1 && level >= 2 && level <= 4)
+				levels |= 1 << level;
+		}
+		fclose(f);
+	}
+
+	__atomic_store_n(&hwcaps_levels, levels, __ATOMIC_RELEASE);
+	return levels;
+}
+
+// Find an optimized variant of a library that is dlopened with a full path,
+// for example $APPDIR/shared/lib/foo/libfoo.so may have a copy compiled for
+// x86-64-v3 in $APPDIR/shared/lib/foo/glibc-hwcaps/x86-64-v3/libfoo.so
+//
+// We do not handle plain library names since ld.so already searches the
+// glibc-hwcaps subdirs of every dir in the library path for those.
+// Only libraries inside APPDIR are checked to avoid pointless lookups.
+// Returns an allocated path that must be freed or NULL if there is no variant
+static char *find_hwcaps_variant(const char *filename) {
+	static const char *hwcaps_subdirs[] = { NULL, NULL, "x86-64-v2", "x86-64-v3", "x86-64-v4" };
+
+	const char *slash = strrchr(filename, '/');
+	if (!slash || !saved_appdir[0])
+		return NULL;
+
+	size_t appdir_len = strlen(saved_appdir);
+	if (strncmp(filename, saved_appdir, appdir_len) != 0 || filename[appdir_len] != '/')
 		return NULL;
+
+	// already a variant, do not look for glibc-hwcaps inside glibc-hwcaps
+	if (strstr(filename, "/glibc-hwcaps/"))
+		return NULL;
+
+	int levels = get_hwcaps_levels();
+	if (!levels)
+		return NULL;
+
+	char path[PATH_MAX];
+	for (int level = get_x86_64_level(); level >= 2; level--) {
+		if (!(levels & (1 << level)))
+			continue;
+		int n = snprintf(path, sizeof(path), "%.*s/glibc-hwcaps/%s%s",
+			(int)(slash - filename), filename, hwcaps_subdirs[level], slash);
+		if (n < 0 || (size_t)n >= sizeof(path))
+			return NULL;
+		if (access(path, F_OK) == 0)
+			return strdup(path);
 	}
+	return NULL;
+}
 
-	// NULL filename means the caller wants a handle to the main program
-	if (filename && should_block_library(filename)) {
+// Negative cache of libraries that failed to dlopen by name
+// Apps often probe long lists of optional libraries (codecs, libcuda, etc) and
+// each failed probe searches every library dir, including the ones in the FUSE
+// mount. Misses are saved to $XDG_CACHE_HOME/anylinux/dlopen-<key> where the key
+// is a hash of the hostname, the AppImage and the executable. The file starts
+// with a fingerprint of the library search dirs, when it changes the cache is
+// discarded. Dirs inside a mounted AppImage cannot change so only their path
+// relative to APPDIR is used, other dirs use their inode and mtime, which
+// change when a library is added or removed from them.
+// Entries are only valid for the search path of the main program, dlopen calls
+// from objects with their own RPATH or RUNPATH always go to ld.so.
+#define DLOPEN_CACHE_VERSION "anylinux-dlopen-cache-1"
+#define DLOPEN_CACHE_MAX_ENTRIES 1024
+
+struct dlopen_cache_entry {
+	uint64_t hash;
+	char *name;
+};
+
+static pthread_mutex_t dlopen_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dlopen_cache_state = 0; // 0 not loaded, 1 enabled, -1 disabled
+static char dlopen_cache_file[PATH_MAX] = "";
+static struct dlopen_cache_entry *dlopen_cache_entries = NULL;
+static size_t dlopen_cache_count = 0;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint64_t fnv1a_str(uint64_t hash, const char *str) {
+	// include the terminator so "ab"+"c" and "a"+"bc" differ
+	return fnv1a(hash, str, strlen(str) + 1);
+}
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+// paths inside a mounted AppImage are hashed relative to APPDIR since the
+// mount point is random, anything else also hashes its inode and mtime
+static uint64_t fingerprint_path(uint64_t hash, const char *path) {
+	size_t appdir_len = strlen(saved_appdir);
+	if (getenv("APPIMAGE") && appdir_len &&
+	    strncmp(path, saved_appdir, appdir_len) == 0 &&
+	    (path[appdir_len] == '/' || path[appdir_len] == '\0'))
+		return fnv1a_str(hash, path + appdir_len);
+
+	hash = fnv1a_str(hash, path);
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		hash = fnv1a(hash, &st.st_dev, sizeof(st.st_dev));
+		hash = fnv1a(hash, &st.st_ino, sizeof(st.st_ino));
+		hash = fnv1a(hash, &st.st_mtim, sizeof(st.st_mtim));
+	}
+	return hash;
+}
+
+static uint64_t dlopen_cache_fingerprint(dlopen_func_t dlopen_orig) {
+	uint64_t hash = FNV1A_INIT;
+
+	// ld.so.cache is used for libraries that are not in the search dirs
+	hash = fingerprint_path(hash, "/etc/ld.so.cache");
+
+	// the search path of the main program, this includes LD_LIBRARY_PATH,
+	// the --library-path set by sharun, RUNPATH and the default dirs
+	void *self = dlopen_orig(NULL, RTLD_LAZY);
+	Dl_serinfo size;
+	if (self && dlinfo(self, RTLD_DI_SERINFOSIZE, &size) == 0) {
+		Dl_serinfo *info = malloc(size.dls_size);
+		if (info) {
+			info->dls_size = size.dls_size;
+			info->dls_cnt = size.dls_cnt;
+			if (dlinfo(self, RTLD_DI_SERINFO, info) == 0) {
+				for (unsigned int i = 0; i < info->dls_cnt; i++)
+					hash = fingerprint_path(hash, info->dls_serpath[i].dls_name);
+			}
+			free(info);
+		}
+	}
+	return hash;
+}
+
+static void dlopen_cache_add_entry(const char *name) {
+	if (dlopen_cache_count >= DLOPEN_CACHE_MAX_ENTRIES)
+		return;
+	if (dlopen_cache_count % 64 == 0) {
+		struct dlopen_cache_entry *new_entries = realloc(dlopen_cache_entries,
+			(dlopen_cache_count + 64) * sizeof(*dlopen_cache_entries));
+		if (!new_entries)
+			return;
+		dlopen_cache_entries = new_entries;
+	}
+	char *copy = strdup(name);
+	if (!copy)
+		return;
+	dlopen_cache_entries[dlopen_cache_count].hash = fnv1a_str(FNV1A_INIT, name);
+	dlopen_cache_entries[dlopen_cache_count].name = copy;
+	dlopen_cache_count++;
+}
+
+static int dlopen_cache_has_entry(const char *name) {
+	uint64_t hash = fnv1a_str(FNV1A_INIT, name);
+	for (size_t i = 0; i < dlopen_cache_count; i++) {
+		if (dlopen_cache_entries[i].hash == hash &&
+		    strcmp(dlopen_cache_entries[i].name, name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// must be called with dlopen_cache_lock held
+static void dlopen_cache_load(uint64_t fingerprint) {
+	__atomic_store_n(&dlopen_cache_state, -1, __ATOMIC_RELEASE);
+
+	// AppRun points XDG_CACHE_HOME to a different dir, we want the real one
+	const char *cache_home = getenv("HOST_XDG_CACHE_HOME");
+	if (!cache_home || !*cache_home)
+		cache_home = getenv("XDG_CACHE_HOME");
+	char fallback[PATH_MAX];
+	if (!cache_home || !*cache_home) {
+		const char *home = getenv("REAL_HOME");
+		if (!home || !*home)
+			home = getenv("HOME");
+		if (!home || !*home)
+			return;
+		snprintf(fallback, sizeof(fallback), "%s/.cache", home);
+		cache_home = fallback;
+	}
+
+	struct utsname uts;
+	char exe[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	exe[len > 0 ? len : 0] = '\0';
+	const char *appimage = getenv("APPIMAGE");
+
+	uint64_t key = FNV1A_INIT;
+	if (uname(&uts) == 0)
+		key = fnv1a_str(key, uts.nodename);
+	key = fnv1a_str(key, appimage && *appimage ? appimage : saved_appdir);
+	key = fingerprint_path(key, exe);
+
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s/anylinux", cache_home);
+	(void)mkdir(cache_home, 0700);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		DEBUG_PRINT("dlopen cache: cannot create %s: %s\n", dir, strerror(errno));
+		return;
+	}
+	int n = snprintf(dlopen_cache_file, sizeof(dlopen_cache_file), "%s/dlopen-%016llx",
+		dir, (unsigned long long)key);
+	if (n < 0 || (size_t)n >= sizeof(dlopen_cache_file))
+		return;
+
+	char header[128];
+	snprintf(header, sizeof(header), "%s %016llx\n", DLOPEN_CACHE_VERSION,
+		(unsigned long long)fingerprint);
+	__atomic_store_n(&dlopen_cache_state, 1, __ATOMIC_RELEASE);
+
+	FILE *f = fopen(dlopen_cache_file, "re");
+	if (f) {
+		char line[PATH_MAX];
+		if (fgets(line, sizeof(line), f) && strcmp(line, header) == 0) {
+			while (fgets(line, sizeof(line), f)) {
+				line[strcspn(line, "\n")] = '\0';
+				if (*line)
+					dlopen_cache_add_entry(line);
+			}
+			fclose(f);
+			DEBUG_PRINT("dlopen cache: loaded %zu entries from %s\n", dlopen_cache_count, dlopen_cache_file);
+			return;
+		}
+		fclose(f);
+		DEBUG_PRINT("dlopen cache: library dirs changed, discarding %s\n", dlopen_cache_file);
+	}
+
+	int fd = open(dlopen_cache_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, header, strlen(header)) != (ssize_t)strlen(header)) {
+		DEBUG_PRINT("dlopen cache: cannot write %s, disabling it\n", dlopen_cache_file);
+		__atomic_store_n(&dlopen_cache_state, -1, __ATOMIC_RELEASE);
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+// returns 1 if the library is known to be missing, 0 if not, -1 if disabled
+static int dlopen_cache_is_missing(dlopen_func_t dlopen_orig, const char *filename) {
+	int state = __atomic_load_n(&dlopen_cache_state, __ATOMIC_ACQUIRE);
+	if (state < 0)
+		return -1;
+
+	if (state == 0) {
+		const char *v = getenv("ANYLINUX_DLOPEN_CACHE");
+		if (v && strcmp(v, "0") == 0) {
+			__atomic_store_n(&dlopen_cache_state, -1, __ATOMIC_RELEASE);
+			return -1;
+		}
+		// dlopen and dlinfo take the ld.so lock and a constructor running under
+		// it can call dlopen again, so this must not happen with our lock held.
+		// Threads racing here just compute the same value twice
+		uint64_t fingerprint = dlopen_cache_fingerprint(dlopen_orig);
+		pthread_mutex_lock(&dlopen_cache_lock);
+		if (dlopen_cache_state == 0)
+			dlopen_cache_load(fingerprint);
+		pthread_mutex_unlock(&dlopen_cache_lock);
+	}
+
+	pthread_mutex_lock(&dlopen_cache_lock);
+	int missing = dlopen_cache_state == 1 ? dlopen_cache_has_entry(filename) : -1;
+	pthread_mutex_unlock(&dlopen_cache_lock);
+	return missing;
+}
+
+static void dlopen_cache_add(const char *filename) {
+	pthread_mutex_lock(&dlopen_cache_lock);
+	if (dlopen_cache_state == 1 && !dlopen_cache_has_entry(filename) &&
+	    dlopen_cache_count < DLOPEN_CACHE_MAX_ENTRIES) {
+		dlopen_cache_add_entry(filename);
+		char line[PATH_MAX];
+		int n = snprintf(line, sizeof(line), "%s\n", filename);
+		int fd = open(dlopen_cache_file, O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (fd >= 0) {
+			if (n > 0 && (size_t)n < sizeof(line) && write(fd, line, n) == n)
+				DEBUG_PRINT("dlopen cache: added %s\n", filename);
+			close(fd);
+		}
+	}
+	pthread_mutex_unlock(&dlopen_cache_lock);
+}
+
+// ld.so reports a library that is not found in any search dir as
+// "<name>: cannot open shared object file: <strerror(ENOENT)>", a library that
+// exists but has a missing dependency is reported with the dependency name
+// instead, those must not be cached since installing the dependency fixes them
+static int is_dlopen_not_found_error(const char *err, const char *filename) {
+	if (!err)
+		return 0;
+	size_t name_len = strlen(filename);
+	if (strncmp(err, filename, name_len) != 0 || strncmp(err + name_len, ": ", 2) != 0)
+		return 0;
+	// strerror is translated, compare with the one of the current locale
+	const char *enoent = strerror(ENOENT);
+	size_t err_len = strlen(err);
+	size_t enoent_len = strlen(enoent);
+	return err_len >= name_len + 2 + enoent_len &&
+		strcmp(err + err_len - enoent_len, enoent) == 0;
+}
+
+// Reading dlerror() clears it, the cache has to read it to know why a library
+// failed, so it keeps a copy that our dlerror() hands out to the caller instead
+// of making ld.so search for the library a second time just to set it again
+static dlerror_func_t dlerror_orig = NULL;
+static __thread char *dlopen_saved_error = NULL;
+static __thread char *dlopen_returned_error = NULL;
+
+// a successful dlsym clears the pending error, so this must only be called
+// when there is none, the dlopen hook and a constructor make sure of that
+static dlerror_func_t get_dlerror_orig(void) {
+	dlerror_func_t fn = __atomic_load_n(&dlerror_orig, __ATOMIC_ACQUIRE);
+	if (!fn) {
+		fn = (dlerror_func_t)dlsym(RTLD_NEXT, "dlerror");
+		__atomic_store_n(&dlerror_orig, fn, __ATOMIC_RELEASE);
+	}
+	return fn;
+}
+
+__attribute__((constructor))
+static void init_dlerror(void) {
+	(void)get_dlerror_orig();
+}
+
+static void dlopen_clear_saved_error(void) {
+	free(dlopen_saved_error);
+	dlopen_saved_error = NULL;
+}
+
+VISIBLE char *dlerror(void) {
+	dlerror_func_t fn = get_dlerror_orig();
+	char *err = fn ? fn() : NULL;
+	if (!dlopen_saved_error)
+		return err;
+
+	// the message must stay valid until the next dlerror() call
+	free(dlopen_returned_error);
+	dlopen_returned_error = dlopen_saved_error;
+	dlopen_saved_error = NULL;
+	return err ? err : dlopen_returned_error;
+}
+
+// Only callers that search the same dirs as the main program can use the
+// cache. ld.so searches the RPATH or RUNPATH of the object that called dlopen,
+// which is anylinux.so when the cache calls it, and loads into its namespace
+static int caller_has_own_search_path(const void *caller) {
+	Dl_info info;
+	struct link_map *map = NULL;
+	if (!dladdr1(caller, &info, (void **)&map, RTLD_DL_LINKMAP) || !map)
+		return 1;
+
+	Lmid_t lmid;
+	if (dlinfo(map, RTLD_DI_LMID, &lmid) != 0 || lmid != LM_ID_BASE)
+		return 1;
+
+	for (const ElfW(Dyn) *dyn = map->l_ld; dyn && dyn->d_tag != DT_NULL; dyn++) {
+		if (dyn->d_tag == DT_RUNPATH || dyn->d_tag == DT_RPATH)
+			return 1;
+	}
+	return 0;
+}
+
+// dlerror() must return a message after we make dlopen return NULL,
+// trigger a real failure with a path that cannot exist to set it
+static void set_dlopen_not_found_error(dlopen_func_t dlopen_orig, const char *filename) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/anylinux-dlopen-cache/%s", filename);
+	(void)dlopen_orig(path, RTLD_NOW);
+}
+
+struct loaded_lib_search {
+	const char *name;
+	char *path;
+};
+
+static int find_loaded_lib(struct dl_phdr_info *info, size_t size, void *data) {
+	struct loaded_lib_search *search = data;
+	const char *basename = strrchr(info->dlpi_name, '/');
+	if (basename && strcmp(basename + 1, search->name) == 0) {
+		search->path = strdup(info->dlpi_name);
+		return 1;
+	}
+	return 0;
+}
+
+// returned by the helpers below when the hook must call the real dlopen itself
+static char dlopen_pass_through_marker;
+#define DLOPEN_PASS_THROUGH ((void *)&dlopen_pass_through_marker)
+
+// dlopen by name without going through the library search when the library
+// is known to be missing on this host, only misses are ever cached
+static void *dlopen_cached(dlopen_func_t dlopen_orig, const char *filename, int flags,
+                           const void *caller, uint64_t start_ns) {
+	if ((flags & RTLD_NOLOAD) || caller_has_own_search_path(caller))
+		return DLOPEN_PASS_THROUGH;
+	int missing = dlopen_cache_is_missing(dlopen_orig, filename);
+	if (missing < 0)
+		return DLOPEN_PASS_THROUGH;
+
+	if (missing) {
+		// it could have been loaded by full path since, RTLD_NOLOAD cannot be
+		// used to check this because ld.so still searches the library dirs
+		struct loaded_lib_search search = { filename, NULL };
+		dl_iterate_phdr(find_loaded_lib, &search);
+		if (search.path) {
+			stats_add(STAT_DLOPEN_PASSTHROUGH, 1);
+			stats_add_time(STAT_DLOPEN_NS, start_ns);
+			void *handle = dlopen_orig(search.path, flags);
+			free(search.path);
+			if (handle)
+				return handle;
+			start_ns = stats_now_ns();
+		}
+		DEBUG_PRINT("dlopen cache: %s is known to be missing\n", filename);
+		set_dlopen_not_found_error(dlopen_orig, filename);
+		stats_add(STAT_DLOPEN_CACHED_MISSING, 1);
+		stats_add_time(STAT_DLOPEN_NS, start_ns);
+		return NULL;
+	}
+
+	// resolved before the call, resolving it after would clear the error
+	dlerror_func_t dlerror_fn = get_dlerror_orig();
+	stats_add(STAT_DLOPEN_PASSTHROUGH, 1);
+	stats_add_time(STAT_DLOPEN_NS, start_ns);
+	void *handle = dlopen_orig(filename, flags);
+	if (handle)
+		return handle;
+
+	// only cache libraries that do not exist, not the ones that failed to load
+	start_ns = stats_now_ns();
+	const char *err = dlerror_fn ? dlerror_fn() : NULL;
+	if (is_dlopen_not_found_error(err, filename))
+		dlopen_cache_add(filename);
+	dlopen_saved_error = err ? strdup(err) : NULL;
+	stats_add_time(STAT_DLOPEN_NS, start_ns);
+	return NULL;
+}
+
+// Block libraries and load optimized variants of bundled libraries when
+// possible, returns DLOPEN_PASS_THROUGH when none of that applies.
+// Not inlined so its stack buffers do not keep dlopen from tail calling
+__attribute__((noinline))
+static void *dlopen_intercept(dlopen_func_t dlopen_orig, const char *filename, int flags,
+                              const void *caller, uint64_t start_ns) {
+	if (should_block_library(filename)) {
 		DEBUG_PRINT("Blocked dlopen of '%s' (matched ANYLINUX_DO_NOT_LOAD_LIBS)\n", filename);
 		// We must make dlerror() return a proper error string after returning NULL
 		// If dlerror() returns NULL here the caller will segfault on the string format.
 		// Trigger a real dlopen failure so the dynamic linker sets the error state.
 		(void)dlopen_orig("/anylinux_blocked_lib_that_does_not_exist.so", RTLD_NOW);
+		stats_add(STAT_DLOPEN_BLOCKED, 1);
+		stats_add_time(STAT_DLOPEN_NS, start_ns);
+		return NULL;
+	}
+
+	char *variant = find_hwcaps_variant(filename);
+	if (variant) {
+		DEBUG_PRINT("dlopen redirected: %s -> %s\n", filename, variant);
+		stats_add_time(STAT_DLOPEN_NS, start_ns);
+		void *handle = dlopen_orig(variant, flags);
+		free(variant);
+		if (handle) {
+			stats_add(STAT_DLOPEN_REDIRECTED, 1);
+			return handle;
+		}
+		DEBUG_PRINT("Failed to dlopen variant (%s), falling back to %s\n", dlerror(), filename);
+		start_ns = stats_now_ns();
+	}
+
+	if (!strchr(filename, '/'))
+		return dlopen_cached(dlopen_orig, filename, flags, caller, start_ns);
+	return DLOPEN_PASS_THROUGH;
+}
+
+#ifndef __OPTIMIZE__
+#warning "without optimizations dlopen is not a tail call, build with -O2 or libraries dlopened by name from a RUNPATH are not found"
+#endif
+
+// Intercept dlopen to block loading of specific libraries
+// and to load optimized variants of bundled libraries when possible.
+// dlopen_ns only counts the time spent in the hook, not in the real dlopen
+VISIBLE void *dlopen(const char *filename, int flags) {
+	uint64_t start_ns = stats_now_ns();
+	dlopen_func_t dlopen_orig = dlsym(RTLD_NEXT, "dlopen");
+	if (!dlopen_orig) {
+		DEBUG_PRINT("Error getting original dlopen symbol: %s\n", dlerror());
 		return NULL;
 	}
 
+	if (startup_profile_enabled)
+		anylinux_startup_mark("first_dlopen");
+
+	// like ld.so, a new call drops the error of the previous one
+	if (dlopen_saved_error)
+		dlopen_clear_saved_error();
+
+	// NULL filename means the caller wants a handle to the main program
+	if (filename) {
+		void *handle = dlopen_intercept(dlopen_orig, filename, flags,
+			__builtin_return_address(0), start_ns);
+		if (handle != DLOPEN_PASS_THROUGH)
+			return handle;
+	}
+
 	DEBUG_PRINT("dlopen pass-through: %s\n", filename ? filename : "(NULL)");
+	stats_add(STAT_DLOPEN_PASSTHROUGH, 1);
+	stats_add_time(STAT_DLOPEN_NS, start_ns);
+	// ld.so searches the RUNPATH of the object that called dlopen and expands
+	// $ORIGIN relative to it, this must stay a tail call with no locals whose
+	// address escapes so that object is our caller and not anylinux.so
 	return dlopen_orig(filename, flags);
 }
@@ -9,6 +9,9 @@
  * USAGE:
  *   GTK_WINDOW_CLASS=fuck.gnome LD_PRELOAD=./gtk-class-fix.so /path/to/app
  *
+ *  It also reports when the GApplication and the first window are created
+ *  to the startup profiler of anylinux.so (ANYLINUX_STARTUP_PROFILE=1)
+ *
  * WARNING:
  *  This was 100% vibed with AI by someone that has no idea about C
  *  It works, but no idea if this can cause weird issues down the line
@@ -37,6 +40,7 @@ static const char *(*real_g_get_prgname)(void);
 static void (*real_gdk_surface_set_app_id)(void *surface, const char *app_id);
 static void (*real_gdk_wayland_window_set_app_id)(void *window, const char *app_id);
 static void (*real_gdk_window_set_app_id)(void *window, const char *app_id);
+static void (*anylinux_startup_mark)(const char *milestone);
 
 static int gtk_init_done = 0;
 
@@ -59,6 +63,7 @@ static void gtk_init(void) {
 	real_gdk_surface_set_app_id = dlsym(RTLD_NEXT, "gdk_surface_set_app_id");
 	real_gdk_wayland_window_set_app_id = dlsym(RTLD_NEXT, "gdk_wayland_window_set_app_id");
 	real_gdk_window_set_app_id = dlsym(RTLD_NEXT, "gdk_window_set_app_id");
+	anylinux_startup_mark = dlsym(RTLD_DEFAULT, "anylinux_startup_mark");
 	__atomic_store_n(&gtk_init_done, 1, __ATOMIC_RELEASE);
 }
 
@@ -66,13 +71,21 @@ static const char *effective_id(const char *requested) {
 	return override_id ? override_id : requested;
 }
 
+static void startup_mark(const char *milestone) {
+	if (anylinux_startup_mark) {
+		anylinux_startup_mark(milestone);
+	}
+}
+
 GApplication *g_application_new(const char *application_id, GApplicationFlags flags) {
 	gtk_init();
+	startup_mark("app_new");
 	return real_g_application_new ? real_g_application_new(effective_id(application_id), flags) : NULL;
 }
 
 GApplication *gtk_application_new(const char *application_id, GApplicationFlags flags) {
 	gtk_init();
+	startup_mark("app_new");
 	return real_gtk_application_new ? real_gtk_application_new(effective_id(application_id), flags) : NULL;
 }
 
@@ -104,6 +117,7 @@ const char *g_get_prgname(void) {
 
 void gdk_surface_set_app_id(void *surface, const char *app_id) {
 	gtk_init();
+	startup_mark("first_window");
 	if (real_gdk_surface_set_app_id) {
 		real_gdk_surface_set_app_id(surface, effective_id(app_id));
 	}
@@ -111,6 +125,7 @@ void gdk_surface_set_app_id(void *surface, const char *app_id) {
 
 void gdk_wayland_window_set_app_id(void *window, const char *app_id) {
 	gtk_init();
+	startup_mark("first_window");
 	if (real_gdk_wayland_window_set_app_id) {
 		real_gdk_wayland_window_set_app_id(window, effective_id(app_id));
 	}
@@ -118,6 +133,7 @@ void gdk_wayland_window_set_app_id(void *window, const char *app_id) {
 
 void gdk_window_set_app_id(void *window, const char *app_id) {
 	gtk_init();
+	startup_mark("first_window");
 	if (real_gdk_window_set_app_id) {
 		real_gdk_window_set_app_id(window, effective_id(app_id));
 	}
@@ -257,6 +257,29 @@ _help_msg() {
 	                       export ANYLINUX_DO_NOT_LOAD_LIBS='libpipewire-0.3.so*'
 	                     Useful for applications that will try to dlopen several
 	                     optional dependencies that you do not want to include.
+	                     Libraries that fail to dlopen because they do not exist
+	                     are remembered in \$XDG_CACHE_HOME/anylinux so the next
+	                     launches do not search for them again, running the
+	                     AppImage with ANYLINUX_DLOPEN_CACHE=0 disables this.
+	                     Counters of what the library does are published while
+	                     the app runs in \$XDG_RUNTIME_DIR/anylinux-stats, read them
+	                     with useful-tools/lib/anylinux-stats.c, ANYLINUX_STATS=0
+	                     disables this.
+	                     Running the AppImage with ANYLINUX_STARTUP_PROFILE=1 logs
+	                     how long startup took to \$XDG_RUNTIME_DIR/anylinux-startup.log
+	                     (loader and library constructors, executable constructors,
+	                     app init and first window with GTK_CLASS_FIX=1), it can
+	                     also be set to a log file path.
+	  HWCAPS_LIB_DIRS  Space or newline-separated list of level:dir entries with
+	                     optimized builds of libraries being deployed, example:
+	                       export HWCAPS_LIB_DIRS='
+	                         x86-64-v3:/opt/myapp-v3/lib
+	                         x86-64-v4:/opt/myapp-v4/lib
+	                       '
+	                     Each library with the same name as a deployed library is
+	                     copied to a glibc-hwcaps/<level> dir next to it and used
+	                     instead at runtime when the CPU supports that level.
+	                     Supported levels: x86-64-v2, x86-64-v3 and x86-64-v4
 	  ALWAYS_SOFTWARE  Set to 1 to enable. Sets several env variables to make
 	                     applications use software rendering only, use this option
 	                     when you do not want hardware acceleration.
@@ -1672,6 +1695,73 @@ _add_anylinux_lib() {
 	_echo "* anylinux.so successfully added!"
 }
 
+# deploy x86-64-v2/v3/v4 variants of deployed libraries to glibc-hwcaps subdirs
+# ld.so picks them automatically when loading libs by name and anylinux.so
+# does the same for libraries that are dlopened with a full path
+_deploy_hwcaps_libs() {
+	if [ -z "$HWCAPS_LIB_DIRS" ]; then
+		return 0
+	elif [ "$APPIMAGE_ARCH" != 'x86_64' ] || [ "$LIB32" = 1 ]; then
+		_err_msg "WARNING: HWCAPS_LIB_DIRS is only supported on x86_64, ignoring"
+		return 0
+	fi
+
+	for entry in $HWCAPS_LIB_DIRS; do
+		level=${entry%%:*}
+		src_dir=${entry#*:}
+		case "$level" in
+			x86-64-v2|x86-64-v3|x86-64-v4) :;;
+			*)
+				_err_msg "ERROR: Unknown level '$level' in HWCAPS_LIB_DIRS"
+				_err_msg "Supported levels are x86-64-v2, x86-64-v3 and x86-64-v4"
+				exit 1
+				;;
+		esac
+		if [ ! -d "$src_dir" ]; then
+			_err_msg "ERROR: '$src_dir' from HWCAPS_LIB_DIRS is not a directory"
+			exit 1
+		fi
+		deployed_level=0
+
+		for l in "$src_dir"/*.so*; do
+			[ -f "$l" ] || continue
+			l_name=${l##*/}
+			deployed=$(find "$DST_LIB_DIR"/ -name "$l_name" \
+				! -path '*/glibc-hwcaps/*' -print 2>/dev/null | head -n 1)
+			[ -n "$deployed" ] || continue
+
+			dst_dir=${deployed%/*}/glibc-hwcaps/$level
+			mkdir -p "$dst_dir"
+			# also copy the target of symlinks, it may not match a deployed name
+			if [ -L "$l" ]; then
+				target=$(readlink -f "$l") || continue
+				[ -f "$dst_dir"/"${target##*/}" ] || cp -fv "$target" "$dst_dir"/"${target##*/}"
+				[ "${target##*/}" = "$l_name" ] || ln -sf "${target##*/}" "$dst_dir"/"$l_name"
+			else
+				cp -fv "$l" "$dst_dir"/"$l_name"
+			fi
+			deployed_level=1
+		done
+
+		# anylinux.so only looks for variants of the levels listed here
+		if [ "$deployed_level" = 1 ] && ! grep -qx "$level" "$APPDIR"/.hwcaps 2>/dev/null; then
+			echo "$level" >> "$APPDIR"/.hwcaps
+		fi
+	done
+
+	_echo "* Deployed optimized library variants from HWCAPS_LIB_DIRS"
+}
+
+# sharun adds every subdir with libraries to lib.path, glibc-hwcaps subdirs
+# must not be there since they would be used even when the CPU lacks support
+_remove_hwcaps_from_lib_path() {
+	libpath=$DST_LIB_DIR/lib.path
+	if [ -f "$libpath" ] && grep -q '/glibc-hwcaps' "$libpath"; then
+		sed -i -e '/\/glibc-hwcaps/d' "$libpath"
+		_echo "* Removed glibc-hwcaps dirs from lib.path"
+	fi
+}
+
 _add_gtk_class_fix() {
 	cfile=$APPDIR/.gtk-class-fix.c
 	target=$DST_LIB_DIR/gtk-class-fix.so
@@ -3103,6 +3193,8 @@ _echo "------------------------------------------------------------"
 echo ""
 
 _check_main_bin
+# variants must be there before the binary patching so they get the same patches
+_deploy_hwcaps_libs
 _map_paths_ld_preload_open
 _map_paths_binary_patch
 _add_anylinux_lib
@@ -3126,13 +3218,17 @@ set -- "$DST_LIB_DIR"/libpipewire-0.3.so*
 set -- "$DST_LIB_DIR"/libdecor-0.so*
 [ -f "$1" ] || no_libdecor=1
 
+# the last two levels are for glibc-hwcaps/x86-64-vN variants next to the
+# deepest libs, they need the same patches as the libs they replace
 set -- \
-	"$DST_LIB_DIR"/*.so*         \
-	"$DST_LIB_DIR"/*/*.so*       \
-	"$DST_LIB_DIR"/*/*/*.so*     \
-	"$DST_LIB_DIR"/*/*/*/*.so*   \
-	"$DST_LIB_DIR"/*/*/*/*/*.so* \
-	"$DST_LIB_DIR"/*/*/*/*/*/*.so*
+	"$DST_LIB_DIR"/*.so*               \
+	"$DST_LIB_DIR"/*/*.so*             \
+	"$DST_LIB_DIR"/*/*/*.so*           \
+	"$DST_LIB_DIR"/*/*/*/*.so*         \
+	"$DST_LIB_DIR"/*/*/*/*/*.so*       \
+	"$DST_LIB_DIR"/*/*/*/*/*/*.so*     \
+	"$DST_LIB_DIR"/*/*/*/*/*/*/*.so*   \
+	"$DST_LIB_DIR"/*/*/*/*/*/*/*/*.so*
 
 # include binaries in this check, since apps may statically link SDL and try dlopen pipewire
 for lib in "$@" "$SHARUN_BIN_DIR"/*; do
@@ -3164,6 +3260,11 @@ done
 
 # now start the post deployment hooks
 for lib do case "$lib" in
+	# variants only need the patches above, hooks that copy the library or
+	# write files next to it must only run for the library they replace
+	*/glibc-hwcaps/*)
+		continue
+		;;
 	*/gio/modules/*.so*)
 		_try_cp "$LIB_DIR"/gio/modules/giomodule.cache "$DST_LIB_DIR"/gio/modules/giomodule.cache
 		;;
@@ -3555,6 +3656,7 @@ _deploy_locale
 
 # make the lib.path file. Very important for sharun to discover bundled libs!
 "$APPDIR"/sharun -g
+_remove_hwcaps_from_lib_path
 
 # on debian some libs may hardcode paths like /usr/lib/x86_64-linux-gnu
 # make a compat symlink so patched paths resolve to bundled libs
@@ -0,0 +1,434 @@
+#!/bin/sh
+
+# Measures how fast an AppDir or AppImage made with quick-sharun starts
+# It runs the application several times in a headless display server and
+# reports percentiles of the time it takes to be ready as JSON, which can
+# be saved and diffed between releases of the same application
+
+# The application is considered ready when one of these happens first:
+# - A window is mapped in Xvfb, this needs 'xdotool'
+# - The application exits, useful to benchmark things like '--version'
+# This is the same for every variant so they can be compared, the startup
+# profiler of anylinux.so is only used for the breakdown of the time
+
+# Every variant is run warm (files already in page cache) and cold (page
+# cache dropped before each run), cold runs need root or passwordless sudo
+# and are skipped otherwise
+
+# Variants that are benchmarked:
+# - appimage   The AppImage as is, only when an AppImage is given
+# - preload    The AppDir with anylinux.so and gtk-class-fix.so preloaded
+# - nopreload  The AppDir without anylinux.so and gtk-class-fix.so
+# When an AppImage is given it is extracted to benchmark the last two.
+# nopreload runs on a hardlinked copy of the AppDir, the .preload file of
+# the given AppDir is never modified
+
+# One extra run per variant is done with LD_DEBUG=statistics to get the time
+# the dynamic linker spent loading and relocating, the unit is what ld.so
+# reports, usually cycles on x86_64
+
+# USAGE: startup-benchmark.sh /path/to/AppDir_or_AppImage [app args]
+
+set -e
+
+RUNS=${RUNS:-10}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-30}
+BENCH_COOLDOWN=${BENCH_COOLDOWN:-1}
+BENCH_DISPLAY=${BENCH_DISPLAY:-xvfb}
+BENCH_OUTPUT=${BENCH_OUTPUT:-}
+WAYLAND_COMPOSITOR=${WAYLAND_COMPOSITOR:-weston --backend=headless --idle-time=0}
+TMPDIR=${TMPDIR:-/tmp}
+RUN_ENV=""
+RUN_STDERR=/dev/null
+
+# github actions doesn't set USER and XDG_RUNTIME_DIR
+# causing some apps crash when running xvfb-run
+export USER="${LOGNAME:-${USER:-${USERNAME:-yomama}}}"
+export XDG_RUNTIME_DIR="${XDG_RUNTIME_DIR:-/tmp}"
+
+_echo() {
+	>&2 printf '\033[1;92m%s\033[0m\n' " $*"
+}
+
+_err_msg(){
+	>&2 printf '\033[1;31m%s\033[0m\n' " $*"
+}
+
+_is_cmd() {
+	for cmd do
+		command -v "$cmd" 1>/dev/null || return 1
+	done
+	return 0
+}
+
+_help_msg() {
+	>&2 cat <<-EOF
+	  USAGE: ${0##*/} /path/to/AppDir_or_AppImage [app args]
+
+	  DESCRIPTION:
+	  Benchmarks the warm and cold startup time of an AppDir or AppImage
+	  with and without anylinux.so and gtk-class-fix.so preloaded and
+	  prints the results as JSON.
+
+	  OPTIONS / ENVIRONMENT VARIABLES:
+	  RUNS                Number of runs for each variant (default: 10).
+	  BENCH_TIMEOUT       Seconds to wait for the application to be ready
+	                        before the run is counted as failed (default: 30).
+	  BENCH_COOLDOWN      Seconds to wait between runs (default: 1).
+	  BENCH_DISPLAY       'xvfb' (default), 'wayland' or 'none'. With wayland
+	                        windows cannot be detected, the application is only
+	                        ready when it exits, same for every variant.
+	                        'none' does not start a display server, only useful
+	                        for command line applications.
+	  WAYLAND_COMPOSITOR  Headless compositor command for BENCH_DISPLAY=wayland
+	                        (default: weston --backend=headless --idle-time=0).
+	  BENCH_OUTPUT        Save the JSON to this file instead of stdout.
+
+	  EXAMPLES:
+	  ${0##*/} ./AppDir
+	  RUNS=30 BENCH_OUTPUT=old.json ${0##*/} ./app-1.0-x86_64.AppImage
+	  ${0##*/} ./AppDir --version
+	EOF
+	exit 1
+}
+
+# prints min, p50, p90, p99, max and mean of the numbers in stdin as JSON
+_stats() {
+	sort -n | awk '
+		function pct(p,   i) {
+			i = int((p / 100) * NR + 0.999999)
+			if (i < 1) i = 1
+			return v[i]
+		}
+		{ v[NR] = $1; sum += $1 }
+		END {
+			if (NR == 0) { printf "null"; exit }
+			printf "{\"n\": %d, \"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f, \"mean\": %.1f}",
+			  NR, v[1], pct(50), pct(90), pct(99), v[NR], sum / NR
+		}'
+}
+
+_now_ms() {
+	t=$(date +%s%N)
+	echo "$((t / 1000000))"
+}
+
+_drop_caches() {
+	sync
+	if [ -w /proc/sys/vm/drop_caches ]; then
+		echo 3 > /proc/sys/vm/drop_caches
+	elif _is_cmd sudo && sudo -n true 2>/dev/null; then
+		sudo -n sh -c 'echo 3 > /proc/sys/vm/drop_caches'
+	else
+		return 1
+	fi
+}
+
+_count_windows() {
+	if [ -n "$DISPLAY" ] && _is_cmd xdotool; then
+		xdotool search --onlyvisible --name '' 2>/dev/null | wc -l
+	else
+		echo 0
+	fi
+}
+
+# the app runs in its own session started by setsid, so its process group
+# has the same id as its pid and takes all of its children with it
+_kill_app() {
+	kill -TERM -"$1" 2>/dev/null || :
+	COUNT=0
+	while kill -0 -"$1" 2>/dev/null && [ "$COUNT" -lt 20 ]; do
+		sleep 0.1
+		COUNT=$((COUNT + 1))
+	done
+	kill -KILL -"$1" 2>/dev/null || :
+	wait "$1" 2>/dev/null || :
+}
+
+# runs the application once and prints the milliseconds it took to be ready
+# followed by the startup profile line of anylinux.so if there was one
+_run_once() {
+	profile=$TMPDIR/startup-benchmark-profile.$$
+	rm -f "$profile"
+	windows=$(_count_windows)
+
+	# 'set -m' does not give the app its own process group without a
+	# controlling terminal, setsid does. A background job of a shell is
+	# never a process group leader, so setsid does not need to fork
+	start=$(_now_ms)
+	setsid env $RUN_ENV ANYLINUX_STARTUP_PROFILE="$profile" "$@" >/dev/null 2>"$RUN_STDERR" &
+	pid=$!
+
+	ready=""
+	while [ -z "$ready" ]; do
+		if ! kill -0 "$pid" 2>/dev/null; then
+			ready=$(_now_ms)
+		elif [ "$(_count_windows)" -gt "$windows" ]; then
+			ready=$(_now_ms)
+		elif [ $(( $(_now_ms) - start )) -gt $((BENCH_TIMEOUT * 1000)) ]; then
+			break
+		else
+			sleep 0.01
+		fi
+	done
+
+	_kill_app "$pid"
+
+	if [ -z "$ready" ]; then
+		_err_msg "Run timed out after $BENCH_TIMEOUT seconds"
+		rm -f "$profile"
+		return 1
+	fi
+
+	echo "$((ready - start))"
+	# prefer the line of the process that made the window
+	if grep -q 'first_window=[0-9]' "$profile" 2>/dev/null; then
+		grep 'first_window=[0-9]' "$profile" | head -n 1
+	elif [ -f "$profile" ]; then
+		head -n 1 "$profile"
+	fi
+	rm -f "$profile"
+}
+
+# prints the JSON of the LD_DEBUG=statistics values of the last process
+# the app is started last, the AppRun shell and others print theirs before
+_ldso_stats() {
+	log=$TMPDIR/startup-benchmark-ldso.$$
+	RUN_ENV=LD_DEBUG=statistics RUN_STDERR=$log _run_once "$@" >/dev/null || :
+	RUN_ENV="" RUN_STDERR=/dev/null
+
+	awk '
+		/total startup time in dynamic loader:/ {
+			startup = $(NF - 1); unit = $NF; reloc = ""; load = ""; relocs = ""
+		}
+		/time needed for relocation:/ { reloc = $(NF - 2) }
+		/time needed to load objects:/ { load = $(NF - 2) }
+		/[^l] number of relocations:/ { if (relocs == "") relocs = $NF }
+		END {
+			if (startup == "") { printf "null"; exit }
+			printf "{\"unit\": \"%s\", \"total\": %s, \"relocation\": %s, \"load_objects\": %s, \"relocations\": %s}",
+			  unit, startup, reloc == "" ? "null" : reloc, load == "" ? "null" : load,
+			  relocs == "" ? "null" : relocs
+		}' "$log"
+	rm -f "$log"
+}
+
+# benchmarks one variant and prints its JSON object
+_bench_variant() {
+	name=$1
+	shift
+
+	for mode in warm cold; do
+		times=""
+		loader_and_lib_ctors="" exe_ctors="" app_init="" first_window=""
+		if [ "$mode" = cold ] && [ "$CAN_DROP_CACHES" != 1 ]; then
+			eval "${name}_$mode=null"
+			continue
+		fi
+
+		# a first run that is not counted so warm runs are actually warm
+		if [ "$mode" = warm ]; then
+			_run_once "$@" >/dev/null || :
+			sleep "$BENCH_COOLDOWN"
+		fi
+
+		i=1
+		while [ "$i" -le "$RUNS" ]; do
+			_echo "[$name] $mode run $i/$RUNS"
+			[ "$mode" = warm ] || _drop_caches
+			if out=$(_run_once "$@"); then
+				times=$(printf '%s\n%s' "$times" "$(echo "$out" | head -n 1)")
+				line=$(echo "$out" | sed -n 2p)
+				for f in loader_and_lib_ctors exe_ctors app_init first_window; do
+					v=$(echo "$line" | tr ' ' '\n' | awk -F'=' -v f="$f" '$1 == f && $2 ~ /ms$/ {sub(/ms$/, "", $2); print $2}')
+					[ -n "$v" ] || continue
+					eval "$f=\$(printf '%s\n%s' \"\$$f\" \"\$v\")"
+				done
+			fi
+			sleep "$BENCH_COOLDOWN"
+			i=$((i + 1))
+		done
+
+		json="{\"ready_ms\": $(echo "$times" | sed '/^$/d' | _stats)"
+		for f in loader_and_lib_ctors exe_ctors app_init first_window; do
+			eval "v=\$$f"
+			json="$json, \"${f}_ms\": $(echo "$v" | sed '/^$/d' | _stats)"
+		done
+		eval "${name}_$mode=\$json}"
+	done
+
+	_echo "[$name] ld.so statistics run"
+	ldso=$(_ldso_stats "$@")
+
+	eval "warm=\$${name}_warm cold=\$${name}_cold"
+	printf '    "%s": {\n      "warm": %s,\n      "cold": %s,\n      "ldso": %s\n    }' \
+		"$name" "$warm" "$cold" "$ldso"
+}
+
+# prints a JSON string with the characters that need it escaped
+_json_str() {
+	printf '"%s"' "$(printf '%s' "$1" | sed -e 's/\\/\\\\/g' -e 's/"/\\"/g' \
+		-e 's/\t/\\t/g' -e ':a' -e 'N' -e '$!ba' -e 's/\n/\\n/g')"
+}
+
+# makes a copy of the AppDir without anylinux.so and gtk-class-fix.so in
+# .preload, the AppDir of the user is never modified so nothing is left
+# broken if this script is killed. Files are hardlinked when possible, this
+# is fast and the copy shares the page cache with the original
+_make_nopreload_appdir() {
+	if [ -n "$EXTRACT_DIR" ]; then
+		NOPRELOAD_DIR=$APPDIR
+	else
+		NOPRELOAD_DIR=$APPDIR.bench-nopreload.$$
+		_echo "Making a copy of $APPDIR for the nopreload runs..."
+		cp -al "$APPDIR" "$NOPRELOAD_DIR" 2>/dev/null \
+			|| { rm -rf "$NOPRELOAD_DIR"; cp -a "$APPDIR" "$NOPRELOAD_DIR"; }
+	fi
+
+	preload=$NOPRELOAD_DIR/.preload
+	[ -f "$preload" ] || return 0
+	# remove it first, writing to it would change the hardlinked original
+	content=$(grep -v -e '^anylinux\.so$' -e '^gtk-class-fix\.so$' "$preload" || :)
+	rm -f "$preload"
+	[ -z "$content" ] || printf '%s\n' "$content" > "$preload"
+}
+
+_cleanup() {
+	if [ -n "$NOPRELOAD_DIR" ] && [ "$NOPRELOAD_DIR" != "$APPDIR" ]; then
+		rm -rf "$NOPRELOAD_DIR"
+	fi
+	if [ -n "$COMPOSITOR_PID" ]; then
+		kill "$COMPOSITOR_PID" 2>/dev/null || :
+	fi
+	if [ -n "$EXTRACT_DIR" ]; then
+		rm -rf "$EXTRACT_DIR"
+	fi
+}
+
+if [ -z "$1" ] || [ "$1" = '--help' ] || [ "$1" = '-h' ]; then
+	_help_msg
+fi
+
+if ! _is_cmd awk date setsid sort; then
+	_err_msg "ERROR: this needs awk, date, setsid and sort"
+	exit 1
+fi
+
+APP=$(readlink -f "$1")
+shift
+
+# start the display server, xvfb-run re-runs this script inside of it
+case "$BENCH_DISPLAY" in
+	xvfb)
+		if [ -z "$_BENCH_IN_XVFB" ]; then
+			if ! _is_cmd xvfb-run; then
+				_err_msg "ERROR: BENCH_DISPLAY=xvfb requires 'xvfb-run'"
+				exit 1
+			fi
+			export _BENCH_IN_XVFB=1
+			exec xvfb-run -a -s '-screen 0 1280x1024x24' -- sh "$0" "$APP" "$@"
+		fi
+		unset WAYLAND_DISPLAY
+		if ! _is_cmd xdotool; then
+			_err_msg "WARNING: 'xdotool' not found, windows cannot be detected"
+			_err_msg "Only the app exiting will be used"
+		fi
+		;;
+	wayland)
+		socket=startup-benchmark-$$
+		$WAYLAND_COMPOSITOR --socket="$socket" >/dev/null 2>&1 &
+		COMPOSITOR_PID=$!
+		COUNT=0
+		while [ ! -S "$XDG_RUNTIME_DIR"/"$socket" ] && [ "$COUNT" -lt 50 ]; do
+			sleep 0.1
+			COUNT=$((COUNT + 1))
+		done
+		if [ ! -S "$XDG_RUNTIME_DIR"/"$socket" ]; then
+			_err_msg "ERROR: '$WAYLAND_COMPOSITOR' did not start"
+			exit 1
+		fi
+		export WAYLAND_DISPLAY="$socket"
+		unset DISPLAY
+		;;
+	none)
+		unset DISPLAY WAYLAND_DISPLAY
+		;;
+	*)
+		_err_msg "ERROR: Unknown BENCH_DISPLAY '$BENCH_DISPLAY'"
+		exit 1
+		;;
+esac
+
+trap _cleanup EXIT
+trap 'exit 1' INT TERM
+
+if _drop_caches 2>/dev/null; then
+	CAN_DROP_CACHES=1
+else
+	_err_msg "WARNING: Cannot drop page cache, cold runs will be skipped"
+	_err_msg "Run as root or with passwordless sudo to enable them"
+fi
+
+if [ -d "$APP" ]; then
+	APPDIR=$APP
+elif [ -f "$APP" ] && [ -x "$APP" ]; then
+	_echo "Extracting $APP..."
+	EXTRACT_DIR=$(mktemp -d "$TMPDIR"/startup-benchmark.XXXXXX)
+	( cd "$EXTRACT_DIR" && "$APP" --appimage-extract >/dev/null )
+	set -- "$EXTRACT_DIR"/*/AppRun "$@"
+	if [ ! -e "$1" ]; then
+		_err_msg "ERROR: Failed to extract $APP"
+		exit 1
+	fi
+	APPDIR=${1%/AppRun}
+	shift
+else
+	_err_msg "ERROR: '$APP' is not an AppDir or an executable AppImage"
+	exit 1
+fi
+
+if [ ! -x "$APPDIR"/AppRun ]; then
+	_err_msg "ERROR: There is no AppRun in $APPDIR"
+	exit 1
+fi
+
+results=""
+if [ -n "$EXTRACT_DIR" ]; then
+	results=$(_bench_variant appimage "$APP" "$@")
+fi
+
+r=$(_bench_variant preload "$APPDIR"/AppRun "$@")
+results="${results:+$results,
+}$r"
+
+_make_nopreload_appdir
+r=$(_bench_variant nopreload "$NOPRELOAD_DIR"/AppRun "$@")
+results="$results,
+$r"
+
+args=""
+for a do
+	args="${args:+$args, }$(_json_str "$a")"
+done
+
+json=$(cat <<-EOF
+{
+  "app": $(_json_str "${APP##*/}"),
+  "args": [$args],
+  "display": $(_json_str "$BENCH_DISPLAY"),
+  "runs": $RUNS,
+  "arch": "$(uname -m)",
+  "kernel": "$(uname -r)",
+  "variants": {
+$results
+  }
+}
+EOF
+)
+
+if [ -n "$BENCH_OUTPUT" ]; then
+	printf '%s\n' "$json" > "$BENCH_OUTPUT"
+	_echo "Saved results to $BENCH_OUTPUT"
+else
+	printf '%s\n' "$json"
+fi